@@ -0,0 +1,200 @@
+#define _GNU_SOURCE    // O_DIRECT and fallocate()
+#include "io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+io_config_t io_config = {
+    .buf_size = IO_DEFAULT_BUF_SIZE,
+    .alignment = IO_DEFAULT_ALIGNMENT,
+    .fadvise = 0,
+    .prealloc = 1,
+    .direct = 0,
+};
+
+// Buffers returned to the pool, linked through their first bytes
+typedef struct pool_entry {
+    struct pool_entry *next;
+} pool_entry_t;
+
+static pool_entry_t *pool_head = NULL;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int io_config_validate(void) {
+    size_t align = io_config.alignment;
+    if (align < sizeof(void *) || (align & (align - 1)) != 0) {
+        fprintf(stderr, "Alignment must be a power of two of at least %zu bytes\n",
+                sizeof(void *));
+        return -1;
+    }
+    // The kernel rejects O_DIRECT transfers smaller than a device's logical block
+    if (io_config.direct && align < IO_MIN_DIRECT_ALIGNMENT) {
+        fprintf(stderr, "Alignment must be at least %d bytes with --direct\n",
+                IO_MIN_DIRECT_ALIGNMENT);
+        return -1;
+    }
+    if (io_config.buf_size == 0 || io_config.buf_size % align != 0) {
+        fprintf(stderr, "Buffer size must be a nonzero multiple of the alignment (%zu bytes)\n",
+                align);
+        return -1;
+    }
+    return 0;
+}
+
+void *io_buffer_get(void) {
+    pthread_mutex_lock(&pool_lock);
+    pool_entry_t *entry = pool_head;
+    if (entry != NULL) {
+        pool_head = entry->next;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (entry != NULL) {
+        return entry;
+    }
+
+    void *buf;
+    if (posix_memalign(&buf, io_config.alignment, io_config.buf_size) != 0) {
+        return NULL;
+    }
+    return buf;
+}
+
+void io_buffer_put(void *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    pool_entry_t *entry = buf;
+    pthread_mutex_lock(&pool_lock);
+    entry->next = pool_head;
+    pool_head = entry;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void io_buffer_pool_clear(void) {
+    pthread_mutex_lock(&pool_lock);
+    pool_entry_t *entry = pool_head;
+    pool_head = NULL;
+    pthread_mutex_unlock(&pool_lock);
+    while (entry != NULL) {
+        pool_entry_t *to_free = entry;
+        entry = entry->next;
+        free(to_free);
+    }
+}
+
+void io_advise_sequential(int fd) {
+    if (io_config.fadvise) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);    // Only a hint, failure is harmless
+    }
+}
+
+void io_advise_done(int fd, off_t offset, off_t len) {
+    if (io_config.fadvise && len > 0) {
+        posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+    }
+}
+
+/*
+ * Opens 'file_name' with 'flags', adding O_DIRECT when it is enabled.
+ * Filesystems that do not support O_DIRECT (e.g. tmpfs) reject it with EINVAL,
+ * in which case the file is opened normally instead.
+ * '*direct' is set to whether O_DIRECT ended up being used.
+ */
+static int open_maybe_direct(const char *file_name, int flags, mode_t mode, int *direct) {
+    if (io_config.direct) {
+        int fd = open(file_name, flags | O_DIRECT, mode);
+        if (fd != -1 || errno != EINVAL) {
+            *direct = (fd != -1);
+            return fd;
+        }
+    }
+    *direct = 0;
+    return open(file_name, flags, mode);
+}
+
+int io_open_input(const char *file_name) {
+    int direct;
+    int fd = open_maybe_direct(file_name, O_RDONLY, 0, &direct);
+    if (fd != -1) {
+        io_advise_sequential(fd);
+    }
+    return fd;
+}
+
+int io_open_output(const char *file_name, off_t size, int *direct) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int fd = open_maybe_direct(file_name, flags, 0666, direct);
+    if (fd == -1 && errno == EACCES) {
+        // An existing file we can't write to, e.g. a read-only copy restored from an
+        // earlier member with the same name. Like tar's default, unlink and recreate it;
+        // this removes any such file the directory lets us delete, whoever owns it
+        int saved_errno = errno;
+        if (unlink(file_name) != 0) {
+            errno = saved_errno;
+            return -1;
+        }
+        fd = open_maybe_direct(file_name, flags, 0666, direct);
+    }
+    if (fd == -1) {
+        return -1;
+    }
+    if (io_config.prealloc && size > 0) {
+        // Reserve the file's space up front so it is not grown one write at a time.
+        // FALLOC_FL_KEEP_SIZE leaves the length alone in case extraction stops early.
+        // Filesystems without fallocate() support simply fall back to growing on write.
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+    }
+    return fd;
+}
+
+ssize_t io_read_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *) buf + done, len - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+int io_write_full(int fd, int direct, void *buf, size_t len) {
+    // O_DIRECT transfers must cover whole aligned blocks
+    if (direct && len % io_config.alignment != 0) {
+        size_t padded = (len / io_config.alignment + 1) * io_config.alignment;
+        memset((char *) buf + len, 0, padded - len);
+        len = padded;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (char *) buf + done, len - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int io_finish_output(int fd, int direct, off_t size) {
+    if (direct && ftruncate(fd, size) != 0) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef _IO_H
+#define _IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define IO_DEFAULT_BUF_SIZE (128 * 1024)
+#define IO_DEFAULT_ALIGNMENT 4096
+// Smallest alignment accepted with O_DIRECT, the logical block size of most devices
+#define IO_MIN_DIRECT_ALIGNMENT 512
+
+// Tunable settings for how member file data is moved to and from disk
+typedef struct {
+    // Size in bytes of each copy buffer handed out by the buffer pool
+    size_t buf_size;
+    // Alignment in bytes of each copy buffer, and the unit of O_DIRECT transfers
+    size_t alignment;
+    // Nonzero to hint sequential access to the kernel and drop consumed pages from its cache
+    int fadvise;
+    // Nonzero to preallocate extracted files to the size recorded in their header
+    int prealloc;
+    // Nonzero to bypass the page cache with O_DIRECT when reading or writing member files
+    int direct;
+} io_config_t;
+
+// Settings used by all I/O helpers, adjusted from the command line before any work starts
+extern io_config_t io_config;
+
+// Check that the current settings are usable together
+// Returns 0 if they are, -1 (after printing a message) otherwise
+int io_config_validate(void);
+
+// Take a buffer of io_config.buf_size bytes, aligned to io_config.alignment, from the pool
+// Returns NULL if a new buffer is needed and cannot be allocated
+void *io_buffer_get(void);
+
+// Return a buffer taken with io_buffer_get() to the pool for reuse
+void io_buffer_put(void *buf);
+
+// Free every buffer currently held by the pool
+void io_buffer_pool_clear(void);
+
+// Tell the kernel 'fd' will be read from start to end, if fadvise hints are enabled
+void io_advise_sequential(int fd);
+
+// Tell the kernel the given range of 'fd' will not be needed again, if fadvise hints are enabled
+void io_advise_done(int fd, off_t offset, off_t len);
+
+// Open the file 'file_name' for reading, with O_DIRECT if enabled and supported
+// Returns the new file descriptor, or -1 on error
+int io_open_input(const char *file_name);
+
+// Create or truncate the file 'file_name' for writing 'size' bytes of data,
+// with O_DIRECT if enabled and supported, and preallocate its space if enabled
+// An existing file that can't be opened for writing (EACCES) is unlinked and recreated,
+// as tar does by default, regardless of who owns it
+// '*direct' is set to whether the descriptor uses O_DIRECT, to pass to the calls below
+// Returns the new file descriptor, or -1 on error
+int io_open_output(const char *file_name, off_t size, int *direct);
+
+// Read from 'fd' until 'len' bytes have been read or the end of the file is reached
+// Returns the number of bytes read, or -1 on error
+ssize_t io_read_full(int fd, void *buf, size_t len);
+
+// Write 'len' bytes from 'buf', a pool buffer, to 'fd'
+// If 'direct' is set, a short final chunk is padded with zeros up to the alignment
+// Returns 0 on success, -1 on error
+int io_write_full(int fd, int direct, void *buf, size_t len);
+
+// Trim any O_DIRECT padding so the output holds exactly 'size' bytes
+// Returns 0 on success, -1 on error
+int io_finish_output(int fd, int direct, off_t size);
+
+#endif    // _IO_H
@@ -4,13 +4,17 @@
 #include <fcntl.h>
 #include <grp.h>
 #include <math.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include "io.h"
 
 #define NUM_TRAILING_BLOCKS 2
 #define MAX_MSG_LEN 128
@@ -20,10 +24,52 @@
 #define MAGIC "ustar"
 
 // Constants to represent different file types
-// We'll only use regular files in this project
+// Archives we create only hold regular files, but extraction also handles directories
 #define REGTYPE '0'
 #define DIRTYPE '5'
 
+// Metadata from a header that extraction restores on the new file
+typedef struct {
+    char name[101];
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    int index;    // Position among the archive's directory entries, later ones win
+} member_meta_t;
+
+// Upper bound on worker threads used by the verify operation
+#define VERIFY_MAX_THREADS 64
+
+// Differences a verify worker can record for a member
+#define VERIFY_MISSING 0x01
+#define VERIFY_SIZE 0x02
+#define VERIFY_MODE 0x04
+#define VERIFY_MTIME 0x08
+#define VERIFY_CONTENTS 0x10
+#define VERIFY_READ_ERROR 0x20
+
+// Files up to this size are read whole into a write batch rather than streamed
+#define SMALL_FILE_MAX (64 * 1024)
+// Capacity of a write batch; must be able to hold a header plus a small file
+#define WRITE_BATCH_SIZE (1024 * 1024)
+
+// Archive output staged in memory so many members can be written at once
+typedef struct {
+    int fd;
+    char *data;
+    size_t used;
+} write_batch_t;
+
+// Work shared between the verify operation's worker threads
+typedef struct {
+    int archive_fd;
+    archive_member_t *members;
+    int num_members;
+    int next;    // Index of the next member to hand out, protected by 'lock'
+    pthread_mutex_t lock;
+} verify_job_t;
+
 /*
  * Helper function to compute the checksum of a tar header block
  * Performs a simple sum over all bytes in the header in accordance with POSIX
@@ -40,55 +86,90 @@ void compute_checksum(tar_header *header) {
     snprintf(header->chksum, 8, "%07o", sum);
 }
 
+/*
+ * Looks up the user name for 'uid', remembering the last answer.
+ * Archives are usually made of files with a single owner, and each
+ * lookup can mean re-reading the password database.
+ * Returns NULL if there is no such user
+ */
+const char *lookup_user_name(uid_t uid) {
+    static uid_t cached_uid;
+    static char cached_name[32];
+    static int cached = 0;
+    if (!cached || cached_uid != uid) {
+        struct passwd *pwd = getpwuid(uid);
+        if (pwd == NULL) {
+            return NULL;
+        }
+        strncpy(cached_name, pwd->pw_name, sizeof(cached_name));
+        cached_uid = uid;
+        cached = 1;
+    }
+    return cached_name;
+}
+
+/*
+ * Looks up the group name for 'gid', remembering the last answer.
+ * Returns NULL if there is no such group
+ */
+const char *lookup_group_name(gid_t gid) {
+    static gid_t cached_gid;
+    static char cached_name[32];
+    static int cached = 0;
+    if (!cached || cached_gid != gid) {
+        struct group *grp = getgrgid(gid);
+        if (grp == NULL) {
+            return NULL;
+        }
+        strncpy(cached_name, grp->gr_name, sizeof(cached_name));
+        cached_gid = gid;
+        cached = 1;
+    }
+    return cached_name;
+}
+
 /*
  * Populates a tar header block pointed to by 'header' with metadata about
- * the file identified by 'file_name'.
+ * the file identified by 'file_name', as reported by stat in 'stat_buf'.
  * Returns 0 on success or -1 if an error occurs
  */
-int fill_tar_header(tar_header *header, const char *file_name) {
+int fill_tar_header(tar_header *header, const char *file_name, const struct stat *stat_buf) {
     memset(header, 0, sizeof(tar_header));
     char err_msg[MAX_MSG_LEN];
-    struct stat stat_buf;
-    // stat is a system call to inspect file metadata
-    if (stat(file_name, &stat_buf) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
-        perror(err_msg);
-        return -1;
-    }
 
     strncpy(header->name, file_name, 100);    // Name of the file, null-terminated string
     snprintf(header->mode, 8, "%07o",
-             stat_buf.st_mode & 07777);    // Permissions for file, 0-padded octal
+             stat_buf->st_mode & 07777);    // Permissions for file, 0-padded octal
 
-    snprintf(header->uid, 8, "%07o", stat_buf.st_uid);    // Owner ID of the file, 0-padded octal
-    struct passwd *pwd = getpwuid(stat_buf.st_uid);       // Look up name corresponding to owner ID
-    if (pwd == NULL) {
+    snprintf(header->uid, 8, "%07o", stat_buf->st_uid);        // Owner ID of the file, 0-padded octal
+    const char *uname = lookup_user_name(stat_buf->st_uid);    // Look up name corresponding to owner ID
+    if (uname == NULL) {
         snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s", file_name);
         perror(err_msg);
         return -1;
     }
-    strncpy(header->uname, pwd->pw_name, 32);    // Owner name of the file, null-terminated string
+    strncpy(header->uname, uname, 32);    // Owner name of the file, null-terminated string
 
-    snprintf(header->gid, 8, "%07o", stat_buf.st_gid);    // Group ID of the file, 0-padded octal
-    struct group *grp = getgrgid(stat_buf.st_gid);        // Look up name corresponding to group ID
-    if (grp == NULL) {
+    snprintf(header->gid, 8, "%07o", stat_buf->st_gid);         // Group ID of the file, 0-padded octal
+    const char *gname = lookup_group_name(stat_buf->st_gid);    // Look up name corresponding to group ID
+    if (gname == NULL) {
         snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s", file_name);
         perror(err_msg);
         return -1;
     }
-    strncpy(header->gname, grp->gr_name, 32);    // Group name of the file, null-terminated string
+    strncpy(header->gname, gname, 32);    // Group name of the file, null-terminated string
 
     snprintf(header->size, 12, "%011o",
-             (unsigned) stat_buf.st_size);    // File size, 0-padded octal
+             (unsigned) stat_buf->st_size);    // File size, 0-padded octal
     snprintf(header->mtime, 12, "%011o",
-             (unsigned) stat_buf.st_mtime);    // Modification time, 0-padded octal
+             (unsigned) stat_buf->st_mtime);    // Modification time, 0-padded octal
     header->typeflag = REGTYPE;                // File type, always regular file in this project
     strncpy(header->magic, MAGIC, 6);          // Special, standardized sequence of bytes
     memcpy(header->version, "00", 2);          // A bit weird, sidesteps null termination
     snprintf(header->devmajor, 8, "%07o",
-             major(stat_buf.st_dev));    // Major device number, 0-padded octal
+             major(stat_buf->st_dev));    // Major device number, 0-padded octal
     snprintf(header->devminor, 8, "%07o",
-             minor(stat_buf.st_dev));    // Minor device number, 0-padded octal
+             minor(stat_buf->st_dev));    // Minor device number, 0-padded octal
 
     compute_checksum(header);
     return 0;
@@ -124,111 +205,223 @@ int remove_trailing_bytes(const char *file_name, size_t nbytes) {
     return 0;
 }
 
-int add_files_to_tarfile(FILE *tarfile, const file_list_t *files){ // Helper function to add files to the end of an existing tarfile (can be used in create, append, and update)
-    node_t *current_file = files->head;
-
-    // Iterate over all the input files
-    while (current_file != NULL) {
-        FILE *input_file = fopen(current_file->name, "rb");
-        if (!input_file) {
-            perror("Error opening file");
-            fclose(tarfile);
+/*
+ * Writes everything staged in 'batch' to the archive with a single write call.
+ * Returns 0 on success, -1 on error
+ */
+int write_batch_flush(write_batch_t *batch) {
+    size_t done = 0;
+    while (done < batch->used) {
+        ssize_t n = write(batch->fd, batch->data + done, batch->used - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
             return -1;
         }
+        done += n;
+    }
+    batch->used = 0;
+    return 0;
+}
+
+/*
+ * Makes room for 'len' more bytes in 'batch', flushing it first if needed.
+ * 'len' must be no larger than WRITE_BATCH_SIZE.
+ * Returns a pointer to the reserved space, or NULL on error
+ */
+char *write_batch_reserve(write_batch_t *batch, size_t len) {
+    if (batch->used + len > WRITE_BATCH_SIZE && write_batch_flush(batch) == -1) {
+        return NULL;
+    }
+    char *space = batch->data + batch->used;
+    batch->used += len;
+    return space;
+}
 
-        // Get the file size
-        if (fseek(input_file, 0, SEEK_END) == -1) {
-            perror("Error seeking in file");
+/*
+ * Stages a zeroed 'len' bytes in 'batch', used for padding and end-of-archive blocks.
+ * Returns 0 on success, -1 on error
+ */
+int write_batch_zeros(write_batch_t *batch, size_t len) {
+    char *space = write_batch_reserve(batch, len);
+    if (space == NULL) {
+        return -1;
+    }
+    memset(space, 0, len);
+    return 0;
+}
+
+/*
+ * Copies the 'filesize' bytes of data in the file 'file_name' straight to the archive,
+ * for files too large to stage in a write batch.
+ * Returns 0 on success, -1 on error
+ */
+int copy_large_file(int archive_fd, const char *file_name, off_t filesize) {
+    int input_fd = io_open_input(file_name);
+    if (input_fd == -1) {
+        perror("Error opening file");
+        return -1;
+    }
+
+    char *buffer = io_buffer_get();
+    if (buffer == NULL) {
+        perror("Memory allocation failed for copy buffer");
+        close(input_fd);
+        return -1;
+    }
+
+    // Copy exactly as much data as the header promises
+    off_t remaining = filesize;
+    while (remaining > 0) {
+        ssize_t bytes_read = io_read_full(input_fd, buffer, io_config.buf_size);
+        if (bytes_read == -1) {
+            perror("Error reading elements");
+            io_buffer_put(buffer);
+            close(input_fd);
             return -1;
         }
-        int filesize = ftell(input_file);
-        if (filesize == -1) {
-            perror("ftell");
+        if (bytes_read == 0 || bytes_read > remaining) {
+            fprintf(stderr, "File %s changed size while being archived\n", file_name);
+            io_buffer_put(buffer);
+            close(input_fd);
             return -1;
         }
-        // Point back to start of file
-        if (fseek(input_file, 0, SEEK_SET) == -1) {
-            perror("Error seeking in file");
+        if (io_write_full(archive_fd, 0, buffer, bytes_read) != 0) {
+            perror("Error writing contents");
+            io_buffer_put(buffer);
+            close(input_fd);
             return -1;
         }
+        remaining -= bytes_read;
+    }
+    io_buffer_put(buffer);
 
-        // Prepare the TAR header
-        tar_header *header = malloc(sizeof(tar_header));
-        if (header == NULL) {
-            perror("Memory allocation failed for tar header");
-            fclose(input_file);
-            fclose(tarfile);
-            return -1;
-        }
+    // The input is read exactly once, so there's no point keeping it cached
+    io_advise_done(input_fd, 0, filesize);
+    if (close(input_fd) != 0) {
+        perror("close()");
+        return -1;
+    }
+    return 0;
+}
 
-        // Fill TAR header
-        if (fill_tar_header(header, current_file->name) == -1) {
-            perror("Error filling tar header");
-            fclose(input_file);
-            fclose(tarfile);
+/*
+ * Stages the contents of the small file 'file_name' in 'batch', reading it with a single
+ * read call into the space after its header.
+ * Returns 0 on success, -1 on error
+ */
+int stage_small_file(write_batch_t *batch, const char *file_name, off_t filesize) {
+    int input_fd = open(file_name, O_RDONLY);
+    if (input_fd == -1) {
+        perror("Error opening file");
+        return -1;
+    }
+    char *space = write_batch_reserve(batch, filesize);
+    if (space == NULL) {
+        perror("Error writing contents");
+        close(input_fd);
+        return -1;
+    }
+    ssize_t bytes_read = io_read_full(input_fd, space, filesize);
+    if (bytes_read == -1) {
+        perror("Error reading elements");
+        close(input_fd);
+        return -1;
+    }
+    if (bytes_read != filesize) {
+        fprintf(stderr, "File %s changed size while being archived\n", file_name);
+        close(input_fd);
+        return -1;
+    }
+    if (close(input_fd) != 0) {
+        perror("close()");
+        return -1;
+    }
+    return 0;
+}
+
+// Helper function to add files to the end of an existing tarfile (can be used in create, append, and update)
+// Headers, small files and padding for consecutive members are gathered into one
+// buffer and written together, so a small member costs only stat+open+read+close
+int add_files_to_tarfile(FILE *tarfile, const file_list_t *files) {
+    // All output below goes straight to the file descriptor
+    if (fflush(tarfile) == EOF) {
+        perror("Error flushing tar file");
+        return -1;
+    }
+
+    write_batch_t batch;
+    batch.fd = fileno(tarfile);
+    batch.used = 0;
+    batch.data = malloc(WRITE_BATCH_SIZE);
+    if (batch.data == NULL) {
+        perror("Memory allocation failed for write batch");
+        return -1;
+    }
+
+    // Iterate over all the input files
+    node_t *current_file = files->head;
+    while (current_file != NULL) {
+        char err_msg[MAX_MSG_LEN];
+        struct stat stat_buf;
+        if (stat(current_file->name, &stat_buf) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", current_file->name);
+            perror(err_msg);
+            free(batch.data);
             return -1;
         }
+        off_t filesize = stat_buf.st_size;
 
-        // Write the TAR header to the archive
-        if (fwrite(header, 1, BLOCK_SIZE, tarfile) != BLOCK_SIZE) {
+        // Fill TAR header directly in the batch
+        tar_header *header = (tar_header *) write_batch_reserve(&batch, BLOCK_SIZE);
+        if (header == NULL) {
             perror("Error writing header");
-            fclose(input_file);
-            fclose(tarfile);
+            free(batch.data);
+            return -1;
+        }
+        if (fill_tar_header(header, current_file->name, &stat_buf) == -1) {
+            perror("Error filling tar header");
+            free(batch.data);
             return -1;
         }
 
-        // Write the file data to the archive
-        char buffer[BLOCK_SIZE];
-        size_t bytes_read;
-        while ((bytes_read = fread(buffer, 1, sizeof(buffer), input_file)) > 0) {
-            if (fwrite(buffer, 1, bytes_read, tarfile) != bytes_read) {
-                perror("Error writing contents");
-                fclose(input_file);
-                fclose(tarfile);
-                return -1;
-            }
+        // Small files join the batch, larger ones are streamed after flushing it
+        int result;
+        if (filesize <= SMALL_FILE_MAX) {
+            result = stage_small_file(&batch, current_file->name, filesize);
+        } else if (write_batch_flush(&batch) == -1) {
+            perror("Error writing header");
+            result = -1;
+        } else {
+            result = copy_large_file(batch.fd, current_file->name, filesize);
         }
-        if (ferror(input_file)) {
-            perror("Error reading elements");
-            fclose(input_file);
-            fclose(tarfile);
+        if (result == -1) {
+            free(batch.data);
             return -1;
         }
 
         // Add padding to align to the 512-byte boundary
-        int padding_size = BLOCK_SIZE - (filesize % BLOCK_SIZE);
-        if (padding_size != BLOCK_SIZE) {
-            char padding[BLOCK_SIZE] = {0};
-            if (fwrite(padding, 1, padding_size, tarfile) != padding_size) {
-                perror("Error writing padding");
-                fclose(input_file);
-                fclose(tarfile);
-                return -1;
-            }
-        }
-
-        if (fclose(input_file) == EOF) {
-            perror("fclose()");
+        int padding_size = (BLOCK_SIZE - (filesize % BLOCK_SIZE)) % BLOCK_SIZE;
+        if (write_batch_zeros(&batch, padding_size) == -1) {
+            perror("Error writing padding");
+            free(batch.data);
             return -1;
         }
+
         // Move to the next file
         current_file = current_file->next;
-        free(header);
     }
 
     // Write two 512-byte blocks of zeros to mark the end of the archive
-    char end_block[BLOCK_SIZE] = {0};
-    if (fwrite(end_block, 1, BLOCK_SIZE, tarfile) != BLOCK_SIZE) {
-        perror("Error writing zero-block");
-        fclose(tarfile);
-        return -1;
-    }
-    if (fwrite(end_block, 1, BLOCK_SIZE, tarfile) != BLOCK_SIZE) {
+    if (write_batch_zeros(&batch, NUM_TRAILING_BLOCKS * BLOCK_SIZE) == -1 ||
+        write_batch_flush(&batch) == -1) {
         perror("Error writing zero-block");
-        fclose(tarfile);
+        free(batch.data);
         return -1;
     }
 
+    free(batch.data);
     return 0;
 }
 
@@ -333,14 +526,152 @@ int get_archive_file_list(const char *archive_name, file_list_t *files) {
     return 0;
 }
 
+/*
+ * Parses the octal number stored in a header field of 'len' bytes.
+ * Fields are not necessarily null-terminated, so the digits are copied out first.
+ * Returns 0 on success or -1 if the field does not hold a valid, non-negative number
+ */
+int parse_octal_field(const char *field, size_t len, long long *value) {
+    char digits[16];
+    if (len >= sizeof(digits)) {
+        return -1;
+    }
+    memcpy(digits, field, len);
+    digits[len] = '\0';
+
+    char *endptr;
+    errno = 0;
+    *value = strtoll(digits, &endptr, 8);
+    // strtoll accepts a sign, but no header field can hold a negative number
+    if (errno != 0 || endptr == digits || *value < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reads the metadata to restore for the member described by 'header' into 'meta'.
+ * Returns 0 on success or -1 if the header holds invalid values
+ */
+int parse_member_meta(const tar_header *header, member_meta_t *meta) {
+    long long mode, uid, gid, mtime;
+    if (parse_octal_field(header->mode, sizeof(header->mode), &mode) != 0 ||
+        parse_octal_field(header->uid, sizeof(header->uid), &uid) != 0 ||
+        parse_octal_field(header->gid, sizeof(header->gid), &gid) != 0 ||
+        parse_octal_field(header->mtime, sizeof(header->mtime), &mtime) != 0) {
+        return -1;
+    }
+    memcpy(meta->name, header->name, sizeof(header->name));
+    meta->name[sizeof(header->name)] = '\0';
+    meta->mode = mode & 07777;
+    meta->uid = uid;
+    meta->gid = gid;
+    meta->mtime = mtime;
+    return 0;
+}
+
+/*
+ * Applies the ownership, permissions and modification time in 'meta' to the open file 'fd'.
+ * Ownership is only restored when running as root; otherwise the file keeps the
+ * extracting user's ownership and the permissions are filtered through 'umask_bits'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int restore_metadata(int fd, const member_meta_t *meta, mode_t umask_bits) {
+    char err_msg[MAX_MSG_LEN + sizeof(meta->name)];
+    mode_t mode = meta->mode;
+    if (geteuid() == 0) {
+        // Changing the owner clears set-user-ID and set-group-ID bits, so chown comes first
+        if (fchown(fd, meta->uid, meta->gid) != 0) {
+            snprintf(err_msg, sizeof(err_msg), "Failed to restore owner of %s", meta->name);
+            perror(err_msg);
+            return -1;
+        }
+    } else {
+        mode &= 0777 & ~umask_bits;
+    }
+    if (fchmod(fd, mode) != 0) {
+        snprintf(err_msg, sizeof(err_msg), "Failed to restore permissions of %s", meta->name);
+        perror(err_msg);
+        return -1;
+    }
+
+    // Access time is set to now, as tar does
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_NOW;
+    times[1].tv_sec = meta->mtime;
+    times[1].tv_nsec = 0;
+    if (futimens(fd, times) != 0) {
+        snprintf(err_msg, sizeof(err_msg), "Failed to restore modification time of %s", meta->name);
+        perror(err_msg);
+        return -1;
+    }
+    return 0;
+}
+
+// Orders directories by name, descending, then latest entry first
+// A path sorts after any of its parents, so children come before the directories holding them
+int compare_directory_meta(const void *a, const void *b) {
+    const member_meta_t *x = a;
+    const member_meta_t *y = b;
+    int cmp = strcmp(y->name, x->name);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return y->index - x->index;
+}
+
+/*
+ * Restores the metadata of every directory extracted, once all members are in place.
+ * Creating entries inside a directory updates its modification time, and a read-only
+ * directory can't be written to, so this has to wait until the end. Children are
+ * finished before their parents, and only the most recently added entry for each
+ * directory is applied. 'dirs' is reordered in the process.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int restore_directory_metadata(member_meta_t *dirs, int num_dirs, mode_t umask_bits) {
+    qsort(dirs, num_dirs, sizeof(member_meta_t), compare_directory_meta);
+    for (int i = 0; i < num_dirs; i++) {
+        // Older entries for the same directory sort right after the latest one
+        if (i > 0 && strcmp(dirs[i].name, dirs[i - 1].name) == 0) {
+            continue;
+        }
+        int fd = open(dirs[i].name, O_RDONLY | O_DIRECTORY);
+        if (fd == -1) {
+            perror("Error opening directory");
+            return -1;
+        }
+        if (restore_metadata(fd, &dirs[i], umask_bits) != 0) {
+            close(fd);
+            return -1;
+        }
+        if (close(fd) != 0) {
+            perror("Error close()");
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int extract_files_from_archive(const char *archive_name) {
     FILE *tarfile = fopen(archive_name, "rb");
     if (!tarfile) {
         perror("Error creating tar file");
         return 1;
     }
+    io_advise_sequential(fileno(tarfile));
 
     tar_header header;
+    off_t dropped = 0;    // Archive bytes already released from the page cache
+
+    // Directories get their metadata restored in one pass at the end
+    member_meta_t *dirs = NULL;
+    int num_dirs = 0;
+    int dirs_capacity = 0;
+
+    // Read the umask without changing it, to filter permissions when not running as root
+    mode_t umask_bits = umask(0);
+    umask(umask_bits);
 
     while (fread(&header, sizeof(tar_header), 1, tarfile) == 1) {
         // End of archive
@@ -354,68 +685,503 @@ int extract_files_from_archive(const char *archive_name) {
         if (errno != 0) {
             perror("Error strtol()");
             fclose(tarfile);
+            free(dirs);
             return -1;
         }
 
+        member_meta_t meta;
+        if (parse_member_meta(&header, &meta) != 0) {
+            fprintf(stderr, "Malformed header for %.100s\n", header.name);
+            fclose(tarfile);
+            free(dirs);
+            return -1;
+        }
+
+        if (header.typeflag == DIRTYPE) {
+            if (mkdir(meta.name, 0700) != 0 && errno != EEXIST) {
+                perror("Error creating directory");
+                fclose(tarfile);
+                free(dirs);
+                return -1;
+            }
+            if (num_dirs == dirs_capacity) {
+                dirs_capacity = (dirs_capacity == 0) ? 16 : dirs_capacity * 2;
+                member_meta_t *grown = realloc(dirs, dirs_capacity * sizeof(member_meta_t));
+                if (grown == NULL) {
+                    perror("Memory allocation failed for directory list");
+                    fclose(tarfile);
+                    free(dirs);
+                    return -1;
+                }
+                dirs = grown;
+            }
+            // "d/" and "d" are the same directory
+            size_t len = strlen(meta.name);
+            while (len > 1 && meta.name[len - 1] == '/') {
+                meta.name[--len] = '\0';
+            }
+            meta.index = num_dirs;
+            dirs[num_dirs++] = meta;
+
+            // Directories carry no data, but skip whatever the header claims just in case
+            int padding = (BLOCK_SIZE - (file_size % BLOCK_SIZE)) % BLOCK_SIZE;
+            if (fseek(tarfile, file_size + padding, SEEK_CUR) == -1) {
+                perror("Error fseek()");
+                fclose(tarfile);
+                free(dirs);
+                return -1;
+            }
+            continue;
+        }
+
         int remaining = file_size;
-        char buffer[BLOCK_SIZE];
+        char *buffer = io_buffer_get();
+        if (buffer == NULL) {
+            perror("Memory allocation failed for copy buffer");
+            fclose(tarfile);
+            free(dirs);
+            return -1;
+        }
 
-        // Open a new file called header.name
-        FILE *new_file = fopen(header.name, "w");
-        if (new_file == NULL) {
+        // Open a new file called header.name, sized to hold its contents
+        int new_direct;
+        int new_fd = io_open_output(header.name, file_size, &new_direct);
+        if (new_fd == -1) {
             perror("Error creating new file");
+            io_buffer_put(buffer);
             fclose(tarfile);
+            free(dirs);
             return -1;
         }
 
         // While there are bytes to still be read
         while (remaining > 0) {
-            // sets the bytes to read to the remaining if it is less than 512 bytes, else just 512 bytes
-            size_t to_read = (remaining < BLOCK_SIZE) ? remaining : BLOCK_SIZE;
-            fread(buffer, 1, to_read, tarfile);
-            if (ferror(tarfile)) {
+            // sets the bytes to read to the remaining if it is less than a full buffer, else a full buffer
+            size_t to_read = (remaining < io_config.buf_size) ? remaining : io_config.buf_size;
+            if (fread(buffer, 1, to_read, tarfile) != to_read) {
                 perror("Error reading from tarfile");
+                io_buffer_put(buffer);
                 fclose(tarfile);
-                fclose(new_file);
+                close(new_fd);
+                free(dirs);
                 return -1;
             }
             // Write bytes read to the new file
-            if (fwrite(buffer, 1, to_read, new_file) != to_read) {
+            if (io_write_full(new_fd, new_direct, buffer, to_read) != 0) {
                 perror("Error writing to new file");
+                io_buffer_put(buffer);
                 fclose(tarfile);
-                fclose(new_file);
+                close(new_fd);
+                free(dirs);
                 return -1;
             }
             // Decrement remaining by however many bytes we read
             remaining -= to_read;
         }
+        io_buffer_put(buffer);
 
         // Calculate the padding used in the tarfile to skip over those bytes
         int padding = (BLOCK_SIZE - (file_size % BLOCK_SIZE)) % BLOCK_SIZE;
         if (fseek(tarfile, padding, SEEK_CUR) == -1) {
             perror("Error fseek()");
             fclose(tarfile);
-            fclose(new_file);
+            close(new_fd);
+            free(dirs);
+            return -1;
+        }
+
+        if (io_finish_output(new_fd, new_direct, file_size) != 0) {
+            perror("Error truncating new file");
+            fclose(tarfile);
+            close(new_fd);
+            free(dirs);
+            return -1;
+        }
+
+        // Restore metadata through the descriptor that's already open, after the last write
+        if (restore_metadata(new_fd, &meta, umask_bits) != 0) {
+            fclose(tarfile);
+            close(new_fd);
+            free(dirs);
             return -1;
         }
 
-        if (fclose(new_file) == EOF) {
-            perror("Error fclose()");
+        if (close(new_fd) != 0) {
+            perror("Error close()");
             fclose(tarfile);
+            free(dirs);
             return -1;
         }
+
+        // Everything up to here has been consumed, so drop it from the page cache
+        off_t consumed = ftello(tarfile);
+        io_advise_done(fileno(tarfile), dropped, consumed - dropped);
+        dropped = consumed;
     }
 
     if (ferror(tarfile)) {
         perror("Error reading from tarfile");
         fclose(tarfile);
+        free(dirs);
         return -1;
     }
 
     if (fclose(tarfile) == EOF) {
         perror("Error fclose()");
+        free(dirs);
+        return -1;
+    }
+
+    if (restore_directory_metadata(dirs, num_dirs, umask_bits) != 0) {
+        free(dirs);
+        return -1;
+    }
+
+    free(dirs);
+    return 0;
+}
+
+/*
+ * Checks the checksum stored in 'header' against the header's contents.
+ * Some tar implementations sum signed bytes rather than unsigned ones, so either is accepted.
+ * Returns 1 if the checksum matches, 0 otherwise
+ */
+int header_checksum_ok(const tar_header *header) {
+    long long stored;
+    if (parse_octal_field(header->chksum, sizeof(header->chksum), &stored) != 0) {
+        return 0;
+    }
+
+    // The checksum field itself counts as if it were all blanks
+    const unsigned char *bytes = (const unsigned char *) header;
+    size_t chksum_start = offsetof(tar_header, chksum);
+    size_t chksum_end = chksum_start + sizeof(header->chksum);
+    long long unsigned_sum = 0;
+    long long signed_sum = 0;
+    for (size_t i = 0; i < sizeof(tar_header); i++) {
+        unsigned char byte = (i >= chksum_start && i < chksum_end) ? ' ' : bytes[i];
+        unsigned_sum += byte;
+        signed_sum += (signed char) byte;
+    }
+    return stored == unsigned_sum || stored == signed_sum;
+}
+
+/*
+ * Reads exactly 'len' bytes from 'fd' at position 'offset' into 'buf'.
+ * Returns 0 on success, -1 on error or if the file ends early
+ */
+int pread_full(int fd, void *buf, size_t len, off_t offset) {
+    char *dest = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, dest, len, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        dest += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+int scan_archive_members(int archive_fd, archive_member_t **members, int *num_members) {
+    struct stat stat_buf;
+    if (fstat(archive_fd, &stat_buf) != 0) {
+        perror("Failed to stat archive");
         return -1;
     }
 
+    archive_member_t *list = NULL;
+    int count = 0;
+    int capacity = 0;
+    off_t offset = 0;
+    tar_header header;
+
+    while (offset + BLOCK_SIZE <= stat_buf.st_size) {
+        if (pread_full(archive_fd, &header, sizeof(tar_header), offset) != 0) {
+            perror("Error reading header");
+            free(list);
+            return -1;
+        }
+        // End of archive
+        if (header.name[0] == '\0') {
+            break;
+        }
+
+        if (!header_checksum_ok(&header)) {
+            fprintf(stderr, "Header checksum mismatch at offset %lld\n", (long long) offset);
+            free(list);
+            return -1;
+        }
+
+        long long size, mode, mtime;
+        if (parse_octal_field(header.size, sizeof(header.size), &size) != 0 ||
+            parse_octal_field(header.mode, sizeof(header.mode), &mode) != 0 ||
+            parse_octal_field(header.mtime, sizeof(header.mtime), &mtime) != 0) {
+            fprintf(stderr, "Malformed header at offset %lld\n", (long long) offset);
+            free(list);
+            return -1;
+        }
+
+        off_t padding = (BLOCK_SIZE - (size % BLOCK_SIZE)) % BLOCK_SIZE;
+        if (offset + BLOCK_SIZE + size + padding > stat_buf.st_size) {
+            fprintf(stderr, "Unexpected end of archive in member %.100s\n", header.name);
+            free(list);
+            return -1;
+        }
+
+        if (count == capacity) {
+            capacity = (capacity == 0) ? 64 : capacity * 2;
+            archive_member_t *grown = realloc(list, capacity * sizeof(archive_member_t));
+            if (grown == NULL) {
+                perror("Memory allocation failed for member list");
+                free(list);
+                return -1;
+            }
+            list = grown;
+        }
+
+        archive_member_t *member = &list[count++];
+        memset(member, 0, sizeof(archive_member_t));
+        memcpy(member->name, header.name, sizeof(header.name));    // name[100] stays '\0'
+        member->offset = offset + BLOCK_SIZE;
+        member->size = size;
+        member->mode = mode & 07777;
+        member->mtime = mtime;
+
+        // parse_octal_field only yields non-negative sizes, so the offset can only fail
+        // to advance if this sum overflows; refuse rather than loop forever
+        off_t next_offset = offset + BLOCK_SIZE + size + padding;
+        if (next_offset <= offset) {
+            fprintf(stderr, "Malformed header at offset %lld\n", (long long) offset);
+            free(list);
+            return -1;
+        }
+        offset = next_offset;
+    }
+
+    *members = list;
+    *num_members = count;
+    return 0;
+}
+
+// Orders (name, index) pairs by name, then by position in the archive
+typedef struct {
+    const char *name;
+    int index;
+} name_index_t;
+
+int compare_name_index(const void *a, const void *b) {
+    const name_index_t *x = a;
+    const name_index_t *y = b;
+    int cmp = strcmp(x->name, y->name);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return x->index - y->index;
+}
+
+int mark_latest_members(archive_member_t *members, int num_members) {
+    if (num_members == 0) {
+        return 0;
+    }
+    name_index_t *order = malloc(num_members * sizeof(name_index_t));
+    if (order == NULL) {
+        perror("Memory allocation failed for member index");
+        return -1;
+    }
+    for (int i = 0; i < num_members; i++) {
+        order[i].name = members[i].name;
+        order[i].index = i;
+    }
+    qsort(order, num_members, sizeof(name_index_t), compare_name_index);
+    for (int i = 0; i < num_members; i++) {
+        if (i == num_members - 1 || strcmp(order[i].name, order[i + 1].name) != 0) {
+            members[order[i].index].latest = 1;
+        }
+    }
+    free(order);
     return 0;
 }
+
+/*
+ * Compares a single archive member against the file of the same name,
+ * recording any differences in the member's 'status' field
+ */
+void verify_member(int archive_fd, archive_member_t *member, char *archive_buf, char *file_buf) {
+    // Older versions of a file have already passed their header check,
+    // and there is nothing on disk to compare them with
+    if (!member->latest) {
+        return;
+    }
+
+    struct stat stat_buf;
+    if (lstat(member->name, &stat_buf) != 0) {
+        member->status |= VERIFY_MISSING;
+        return;
+    }
+    if ((stat_buf.st_mode & 07777) != member->mode) {
+        member->status |= VERIFY_MODE;
+    }
+    if (stat_buf.st_mtime != member->mtime) {
+        member->status |= VERIFY_MTIME;
+    }
+    if (stat_buf.st_size != member->size) {
+        member->status |= VERIFY_SIZE;
+        return;
+    }
+
+    int fd = open(member->name, O_RDONLY);
+    if (fd == -1) {
+        member->status |= VERIFY_READ_ERROR;
+        return;
+    }
+    io_advise_sequential(fd);
+    off_t done = 0;
+    while (done < member->size) {
+        size_t chunk = (member->size - done < io_config.buf_size) ? member->size - done : io_config.buf_size;
+        if (pread_full(archive_fd, archive_buf, chunk, member->offset + done) != 0 ||
+            pread_full(fd, file_buf, chunk, done) != 0) {
+            member->status |= VERIFY_READ_ERROR;
+            break;
+        }
+        if (memcmp(archive_buf, file_buf, chunk) != 0) {
+            member->status |= VERIFY_CONTENTS;
+            break;
+        }
+        done += chunk;
+    }
+    // Both copies are only read once, so don't let them push other data out of the cache
+    io_advise_done(archive_fd, member->offset, member->size);
+    io_advise_done(fd, 0, member->size);
+    close(fd);
+}
+
+/*
+ * Worker thread for the verify operation.
+ * Repeatedly claims the next unchecked member until none remain.
+ */
+void *verify_worker(void *arg) {
+    verify_job_t *job = arg;
+    char *archive_buf = io_buffer_get();
+    char *file_buf = io_buffer_get();
+    if (archive_buf == NULL || file_buf == NULL) {
+        io_buffer_put(archive_buf);
+        io_buffer_put(file_buf);
+        return NULL;    // The remaining workers pick up this one's share
+    }
+
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        int i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->num_members) {
+            break;
+        }
+        verify_member(job->archive_fd, &job->members[i], archive_buf, file_buf);
+    }
+    io_buffer_put(archive_buf);
+    io_buffer_put(file_buf);
+    return NULL;
+}
+
+int verify_archive(const char *archive_name) {
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (archive_fd == -1) {
+        perror("Error opening tar file");
+        return -1;
+    }
+    io_advise_sequential(archive_fd);
+
+    verify_job_t job;
+    job.archive_fd = archive_fd;
+    job.next = 0;
+    if (scan_archive_members(archive_fd, &job.members, &job.num_members) == -1) {
+        close(archive_fd);
+        return -1;
+    }
+    if (mark_latest_members(job.members, job.num_members) == -1) {
+        free(job.members);
+        close(archive_fd);
+        return -1;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+
+    // One worker per online core, but never more workers than members
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (num_threads > VERIFY_MAX_THREADS) {
+        num_threads = VERIFY_MAX_THREADS;
+    }
+    if (num_threads > job.num_members) {
+        num_threads = job.num_members;
+    }
+
+    pthread_t threads[VERIFY_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, verify_worker, &job) != 0) {
+            break;
+        }
+        started++;
+    }
+    // Fall back to checking everything on this thread if no worker could be started
+    if (started == 0 && job.num_members > 0) {
+        verify_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+    // Workers that could not get buffers stop early, so make sure nothing was left unchecked
+    if (job.next < job.num_members) {
+        fprintf(stderr, "Failed to allocate buffers for verify workers\n");
+        free(job.members);
+        close(archive_fd);
+        return -1;
+    }
+
+    // Report differences in archive order, once all workers are done
+    int differences = 0;
+    int read_errors = 0;
+    for (int i = 0; i < job.num_members; i++) {
+        archive_member_t *member = &job.members[i];
+        if (member->status & VERIFY_MISSING) {
+            printf("%s: Missing from filesystem\n", member->name);
+        }
+        if (member->status & VERIFY_MODE) {
+            printf("%s: Mode differs\n", member->name);
+        }
+        if (member->status & VERIFY_MTIME) {
+            printf("%s: Mod time differs\n", member->name);
+        }
+        if (member->status & VERIFY_SIZE) {
+            printf("%s: Size differs\n", member->name);
+        }
+        if (member->status & VERIFY_CONTENTS) {
+            printf("%s: Contents differ\n", member->name);
+        }
+        if (member->status & VERIFY_READ_ERROR) {
+            fprintf(stderr, "%s: Error reading file\n", member->name);
+            read_errors = 1;
+        }
+        if (member->status & ~VERIFY_READ_ERROR) {
+            differences = 1;
+        }
+    }
+
+    free(job.members);
+    if (close(archive_fd) != 0) {
+        perror("close()");
+        return -1;
+    }
+    if (read_errors) {
+        return -1;
+    }
+    return differences;
+}
@@ -1,5 +1,6 @@
 #ifndef _MICROTAR_H
 #define _MICROTAR_H
+#include <sys/types.h>
 #include "file_list.h"
 
 // Standard tar header layout defined by POSIX
@@ -39,6 +40,17 @@ typedef struct {
     char padding[12];
 } tar_header;
 
+// Metadata about one archive member, as found by scan_archive_members()
+typedef struct {
+    char name[101];
+    off_t offset;    // Position of the member's data within the archive
+    off_t size;
+    mode_t mode;
+    time_t mtime;
+    int latest;    // Nonzero if no later member in the archive has the same name
+    int status;    // Scratch space for callers, e.g. differences found by verify
+} archive_member_t;
+
 /*
  * Create a new archive file with the name 'archive_name'.
  * The archive should contain all files stored in the 'files' list.
@@ -77,4 +89,33 @@ int get_archive_file_list(const char *archive_name, file_list_t *files);
  */
 int extract_files_from_archive(const char *archive_name);
 
+/*
+ * Check the archive identified by 'archive_name' for damage and compare it
+ * against the files in the current working directory.
+ * Every header's checksum is validated, and the most recently added version of
+ * each member is compared with the file of the same name: size, permission bits,
+ * modification time and contents. Members are compared in parallel on a pool of
+ * worker threads, and any differences are printed once all have been checked.
+ * This function should return 0 if the archive is intact and matches the filesystem,
+ * 1 if any differences were found, or -1 if an error occurred.
+ */
+int verify_archive(const char *archive_name);
+
+/*
+ * Walk every header in the archive open as 'archive_fd', validating its checksum
+ * and recording the member's metadata.
+ * On success, '*members' points to a newly allocated array (which the caller must free)
+ * and '*num_members' holds its length.
+ * This function should return 0 upon success or -1 if an error occurred or the
+ * archive is damaged.
+ */
+int scan_archive_members(int archive_fd, archive_member_t **members, int *num_members);
+
+/*
+ * Flag the most recently added version of each member name as 'latest',
+ * mirroring which version extraction would leave on disk.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int mark_latest_members(archive_member_t *members, int num_members);
+
 #endif    // _microTAR_H
@@ -1,12 +1,93 @@
 #include "microtar.h"
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "file_list.h"
+#include "io.h"
+#include "server.h"
+
+/*
+ * Parses a byte count such as "65536", "64K" or "1M" into 'size'.
+ * Returns 0 on success or -1 if 'text' is not a valid size
+ */
+int parse_size(const char *text, size_t *size) {
+    // strtoull would quietly wrap a negative number around to a huge one
+    if (*text < '0' || *text > '9') {
+        return -1;
+    }
+    char *endptr;
+    errno = 0;
+    unsigned long long value = strtoull(text, &endptr, 10);
+    if (errno != 0 || endptr == text) {
+        return -1;
+    }
+    unsigned long long multiplier = 1;
+    if (*endptr == 'K' || *endptr == 'k') {
+        multiplier = 1024;
+        endptr++;
+    } else if (*endptr == 'M' || *endptr == 'm') {
+        multiplier = 1024 * 1024;
+        endptr++;
+    }
+    if (*endptr != '\0' || value > SIZE_MAX / multiplier) {
+        return -1;
+    }
+    *size = value * multiplier;
+    return 0;
+}
+
+/*
+ * Applies any I/O tuning options (arguments starting with "--") to io_config
+ * and removes them from 'argv', shifting the remaining arguments down and
+ * updating '*argc' to match.
+ * Returns 0 on success or -1 if an option is not recognized or invalid
+ */
+int parse_io_options(int *argc, char **argv) {
+    int kept = 1;
+    for (int i = 1; i < *argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0) {
+            argv[kept++] = argv[i];
+        } else if (strncmp(arg, "--buffer-size=", 14) == 0) {
+            if (parse_size(arg + 14, &io_config.buf_size) != 0) {
+                printf("Error: Invalid buffer size %s\n", arg + 14);
+                return -1;
+            }
+        } else if (strncmp(arg, "--align=", 8) == 0) {
+            if (parse_size(arg + 8, &io_config.alignment) != 0) {
+                printf("Error: Invalid alignment %s\n", arg + 8);
+                return -1;
+            }
+        } else if (strcmp(arg, "--fadvise") == 0) {
+            io_config.fadvise = 1;
+        } else if (strcmp(arg, "--prealloc") == 0) {
+            io_config.prealloc = 1;
+        } else if (strcmp(arg, "--no-prealloc") == 0) {
+            io_config.prealloc = 0;
+        } else if (strcmp(arg, "--direct") == 0) {
+            io_config.direct = 1;
+        } else {
+            printf("Error: Unknown option %s\n", arg);
+            return -1;
+        }
+    }
+    argv[kept] = NULL;
+    *argc = kept;
+    return io_config_validate();
+}
 
 int main(int argc, char **argv) {
+    if (parse_io_options(&argc, argv) != 0) {
+        return 1;
+    }
     if (argc < 4) {
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+        printf("Usage: %s [--buffer-size=N] [--align=N] [--fadvise] [--[no-]prealloc] [--direct] "
+               "-c|a|t|u|x|d -f ARCHIVE [FILE...]\n"
+               "       %s -s -f SOCKET\n",
+               argv[0], argv[0]);
         return 0;
     }
 
@@ -144,6 +225,48 @@ int main(int argc, char **argv) {
         }
     }
 
+    // Verify operator
+    else if (strcmp(argv[1], "-d") == 0) {
+        // Check for -f flag
+        if (strcmp(argv[2], "-f") == 0) {
+
+            // Check the archive and compare it against the filesystem
+            int result = verify_archive(argv[3]);
+            if (result == -1) {
+                printf("Error with verify function");
+                file_list_clear(&files);
+                return 1;
+            }
+            if (result == 1) {
+                file_list_clear(&files);
+                return 1;
+            }
+        } else {
+            printf("Error: Expected -f flag before the archive name.\n");
+            file_list_clear(&files);
+            return 1;
+        }
+    }
+
+    // Serve operator
+    else if (strcmp(argv[1], "-s") == 0) {
+        // Check for -f flag
+        if (strcmp(argv[2], "-f") == 0) {
+
+            // Serve archives over the socket until the server fails
+            if (serve_archives(argv[3]) == -1) {
+                printf("Error with serve function");
+                file_list_clear(&files);
+                return 1;
+            }
+        } else {
+            printf("Error: Expected -f flag before the socket name.\n");
+            file_list_clear(&files);
+            return 1;
+        }
+    }
+
     file_list_clear(&files);
+    io_buffer_pool_clear();
     return 0;
 }
@@ -0,0 +1,447 @@
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "io.h"
+#include "microtar.h"
+
+#define MAX_REQUEST_LEN 512
+// Most catalogs kept at once; each holds its archive open, so this also bounds descriptors
+#define MAX_CATALOGS 64
+// Pause before accepting again when out of descriptors or memory
+#define ACCEPT_BACKOFF_USEC 100000
+
+// Identifies one version of a file: replacing or modifying it changes at least one field
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} file_version_t;
+
+// Parsed, read-only view of one archive, shared by every client reading from it
+typedef struct {
+    // Archive path as clients request it, which identifies the catalog in the table
+    char *path;
+    // Version of the archive file the catalog was built from
+    file_version_t version;
+    // Open descriptor for the archive, used to send member data
+    int fd;
+    // Latest version of each member, sorted by name
+    archive_member_t *members;
+    int num_members;
+    // Number of holders: the catalog table plus any clients currently using it
+    int refcount;
+    // Value of 'use_clock' when the catalog was last handed out, for eviction
+    unsigned long last_used;
+} catalog_t;
+
+// One catalog per archive path requested, up to MAX_CATALOGS.
+// Readers only hold 'table_lock' long enough to take a reference.
+static catalog_t *table[MAX_CATALOGS];
+static int table_size = 0;
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned long use_clock = 0;
+
+void catalog_release(catalog_t *catalog) {
+    if (__atomic_sub_fetch(&catalog->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(catalog->fd);
+        free(catalog->members);
+        free(catalog->path);
+        free(catalog);
+    }
+}
+
+void file_version_from_stat(file_version_t *version, const struct stat *stat_buf) {
+    version->dev = stat_buf->st_dev;
+    version->ino = stat_buf->st_ino;
+    version->size = stat_buf->st_size;
+    version->mtime = stat_buf->st_mtim;
+}
+
+// Returns 1 if 'a' and 'b' describe the same version of the same file, 0 otherwise
+int file_version_equal(const file_version_t *a, const file_version_t *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+// Returns the table slot holding the catalog for the archive at 'path', or -1 if there is none
+// The caller must hold 'table_lock'
+int catalog_find(const char *path) {
+    for (int i = 0; i < table_size; i++) {
+        if (strcmp(table[i]->path, path) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Drops the table's catalog for the archive at 'path', if it has one
+// Clients still reading it keep it alive until they finish
+void catalog_forget(const char *path) {
+    pthread_rwlock_wrlock(&table_lock);
+    int slot = catalog_find(path);
+    if (slot != -1) {
+        catalog_release(table[slot]);
+        table[slot] = table[--table_size];
+    }
+    pthread_rwlock_unlock(&table_lock);
+}
+
+// Records that 'catalog' is being handed out, so it is the last to be evicted
+void catalog_touch(catalog_t *catalog) {
+    unsigned long now = __atomic_add_fetch(&use_clock, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&catalog->last_used, now, __ATOMIC_RELAXED);
+}
+
+// Adds 'catalog' to the table, evicting the least recently used catalog if it is full
+// The caller must hold 'table_lock' for writing
+void catalog_insert(catalog_t *catalog) {
+    if (table_size == MAX_CATALOGS) {
+        int oldest = 0;
+        for (int i = 1; i < table_size; i++) {
+            if (__atomic_load_n(&table[i]->last_used, __ATOMIC_RELAXED) <
+                __atomic_load_n(&table[oldest]->last_used, __ATOMIC_RELAXED)) {
+                oldest = i;
+            }
+        }
+        // Clients still reading the evicted catalog keep it alive until they finish
+        catalog_release(table[oldest]);
+        table[oldest] = table[--table_size];
+    }
+    table[table_size++] = catalog;
+}
+
+int compare_member_names(const void *a, const void *b) {
+    return strcmp(((const archive_member_t *) a)->name, ((const archive_member_t *) b)->name);
+}
+
+/*
+ * Scans the archive 'archive_name' and builds a catalog of its members
+ * Returns the new catalog with a single reference, or NULL if an error occurs
+ */
+catalog_t *catalog_build(const char *archive_name) {
+    catalog_t *catalog = malloc(sizeof(catalog_t));
+    if (catalog == NULL) {
+        return NULL;
+    }
+    catalog->path = strdup(archive_name);
+    if (catalog->path == NULL) {
+        free(catalog);
+        return NULL;
+    }
+    catalog->fd = open(archive_name, O_RDONLY);
+    if (catalog->fd == -1) {
+        free(catalog->path);
+        free(catalog);
+        return NULL;
+    }
+
+    // Record the identity of the file actually scanned, not of whatever is at the path now
+    struct stat stat_buf;
+    archive_member_t *members;
+    int num_members;
+    if (fstat(catalog->fd, &stat_buf) != 0 ||
+        scan_archive_members(catalog->fd, &members, &num_members) != 0) {
+        close(catalog->fd);
+        free(catalog->path);
+        free(catalog);
+        return NULL;
+    }
+    if (mark_latest_members(members, num_members) != 0) {
+        free(members);
+        close(catalog->fd);
+        free(catalog->path);
+        free(catalog);
+        return NULL;
+    }
+
+    // Keep only the versions extraction would produce, packed together and sorted for lookup
+    int kept = 0;
+    for (int i = 0; i < num_members; i++) {
+        if (members[i].latest) {
+            members[kept++] = members[i];
+        }
+    }
+    qsort(members, kept, sizeof(archive_member_t), compare_member_names);
+
+    file_version_from_stat(&catalog->version, &stat_buf);
+    catalog->members = members;
+    catalog->num_members = kept;
+    catalog->refcount = 1;
+    return catalog;
+}
+
+/*
+ * Looks up an up-to-date catalog for the archive 'archive_name', building one if needed
+ * Returns the catalog with a reference held for the caller, or NULL if an error occurs
+ */
+catalog_t *catalog_acquire(const char *archive_name) {
+    struct stat stat_buf;
+    if (stat(archive_name, &stat_buf) != 0) {
+        // The archive is gone, so its catalog would never be used again
+        catalog_forget(archive_name);
+        return NULL;
+    }
+    file_version_t version;
+    file_version_from_stat(&version, &stat_buf);
+
+    // Fast path: the archive is unchanged since its catalog was built
+    pthread_rwlock_rdlock(&table_lock);
+    int slot = catalog_find(archive_name);
+    if (slot != -1 && file_version_equal(&table[slot]->version, &version)) {
+        catalog_t *catalog = table[slot];
+        __atomic_add_fetch(&catalog->refcount, 1, __ATOMIC_RELAXED);
+        catalog_touch(catalog);
+        pthread_rwlock_unlock(&table_lock);
+        return catalog;
+    }
+    pthread_rwlock_unlock(&table_lock);
+
+    // Scan the archive without holding the lock, so other archives stay available
+    catalog_t *fresh = catalog_build(archive_name);
+    if (fresh == NULL) {
+        catalog_forget(archive_name);
+        return NULL;
+    }
+
+    pthread_rwlock_wrlock(&table_lock);
+    slot = catalog_find(archive_name);
+    if (slot != -1 && file_version_equal(&table[slot]->version, &fresh->version)) {
+        // Another client built the same catalog in the meantime
+        catalog_t *existing = table[slot];
+        __atomic_add_fetch(&existing->refcount, 1, __ATOMIC_RELAXED);
+        catalog_touch(existing);
+        pthread_rwlock_unlock(&table_lock);
+        catalog_release(fresh);
+        return existing;
+    }
+    if (slot != -1) {
+        // The archive was modified or replaced; clients still reading the stale
+        // catalog keep it alive until they finish
+        catalog_release(table[slot]);
+        table[slot] = fresh;
+    } else {
+        catalog_insert(fresh);
+    }
+    catalog_touch(fresh);
+    __atomic_add_fetch(&fresh->refcount, 1, __ATOMIC_RELAXED);    // One for the table, one for the caller
+    pthread_rwlock_unlock(&table_lock);
+    return fresh;
+}
+
+// Returns the latest version of the member called 'name' in 'catalog', or NULL if there is none
+const archive_member_t *catalog_lookup(const catalog_t *catalog, const char *name) {
+    archive_member_t key;
+    if (strlen(name) >= sizeof(key.name)) {
+        return NULL;
+    }
+    strcpy(key.name, name);
+    return bsearch(&key, catalog->members, catalog->num_members, sizeof(archive_member_t),
+                   compare_member_names);
+}
+
+/*
+ * Streams the data of 'member' from the archive straight to the client socket 'client'
+ * Returns 0 on success, -1 on error
+ */
+int send_member_data(int client, const catalog_t *catalog, const archive_member_t *member) {
+    off_t offset = member->offset;
+    off_t remaining = member->size;
+    while (remaining > 0) {
+        ssize_t n = sendfile(client, catalog->fd, &offset, remaining);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        remaining -= n;
+    }
+    io_advise_done(catalog->fd, member->offset, member->size);
+    return 0;
+}
+
+/*
+ * Answers a single request line from a client, writing the reply to 'out'
+ * Returns 0 if the connection can take further requests, -1 if it should be closed
+ */
+int handle_request(char *line, int client, FILE *out) {
+    // Split the line into "<command> <archive> [<member>]"
+    char *command = line;
+    char *archive = strchr(command, ' ');
+    if (archive == NULL) {
+        fprintf(out, "ERR Expected an archive name\n");
+        return fflush(out) == EOF ? -1 : 0;
+    }
+    *archive++ = '\0';
+    char *member_name = strchr(archive, ' ');
+    if (member_name != NULL) {
+        *member_name++ = '\0';
+    }
+
+    int is_list = strcmp(command, "LIST") == 0;
+    int is_stat = strcmp(command, "STAT") == 0;
+    int is_read = strcmp(command, "READ") == 0;
+    if (!is_list && !is_stat && !is_read) {
+        fprintf(out, "ERR Unknown command %s\n", command);
+        return fflush(out) == EOF ? -1 : 0;
+    }
+    if (is_list != (member_name == NULL)) {
+        fprintf(out, "ERR Usage: LIST <archive> | STAT <archive> <member> | READ <archive> <member>\n");
+        return fflush(out) == EOF ? -1 : 0;
+    }
+
+    catalog_t *catalog = catalog_acquire(archive);
+    if (catalog == NULL) {
+        fprintf(out, "ERR Failed to read archive %s\n", archive);
+        return fflush(out) == EOF ? -1 : 0;
+    }
+
+    int result = 0;
+    if (is_list) {
+        fprintf(out, "OK %d\n", catalog->num_members);
+        for (int i = 0; i < catalog->num_members; i++) {
+            fprintf(out, "%s\n", catalog->members[i].name);
+        }
+        result = fflush(out) == EOF ? -1 : 0;
+    } else {
+        const archive_member_t *member = catalog_lookup(catalog, member_name);
+        if (member == NULL) {
+            fprintf(out, "ERR No member %s in archive %s\n", member_name, archive);
+            result = fflush(out) == EOF ? -1 : 0;
+        } else if (is_stat) {
+            fprintf(out, "OK %lld %04o %lld\n", (long long) member->size, (unsigned) member->mode,
+                    (long long) member->mtime);
+            result = fflush(out) == EOF ? -1 : 0;
+        } else {
+            // The size line must reach the socket before the data sent around stdio
+            fprintf(out, "OK %lld\n", (long long) member->size);
+            if (fflush(out) == EOF || send_member_data(client, catalog, member) != 0) {
+                result = -1;
+            }
+        }
+    }
+    catalog_release(catalog);
+    return result;
+}
+
+/*
+ * Thread serving every request on one client connection, until the client disconnects
+ */
+void *handle_client(void *arg) {
+    int client = (int) (long) arg;
+    FILE *in = fdopen(client, "r");
+    if (in == NULL) {
+        perror("Failed to set up client connection");
+        close(client);
+        return NULL;
+    }
+    // Replies get their own stream so they can be flushed independently of reads
+    int out_fd = dup(client);
+    FILE *out = (out_fd == -1) ? NULL : fdopen(out_fd, "w");
+    if (out == NULL) {
+        perror("Failed to set up client connection");
+        if (out_fd != -1) {
+            close(out_fd);
+        }
+        fclose(in);
+        return NULL;
+    }
+
+    char line[MAX_REQUEST_LEN];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char *newline = strchr(line, '\n');
+        if (newline == NULL) {
+            fprintf(out, "ERR Request too long\n");
+            break;
+        }
+        *newline = '\0';
+        if (handle_request(line, client, out) != 0) {
+            break;
+        }
+    }
+
+    fclose(out);
+    fclose(in);
+    return NULL;
+}
+
+int serve_archives(const char *socket_path) {
+    char err_msg[MAX_REQUEST_LEN];
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // A client going away mid-reply should only end that client's thread
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        perror("Failed to create socket");
+        return -1;
+    }
+
+    // Replace a socket left behind by an earlier server, but never any other kind of file
+    struct stat stat_buf;
+    if (lstat(socket_path, &stat_buf) == 0 && S_ISSOCK(stat_buf.st_mode)) {
+        unlink(socket_path);
+    }
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        snprintf(err_msg, sizeof(err_msg), "Failed to bind socket %s", socket_path);
+        perror(err_msg);
+        close(listen_fd);
+        return -1;
+    }
+    if (listen(listen_fd, SOMAXCONN) != 0) {
+        perror("Failed to listen on socket");
+        close(listen_fd);
+        return -1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    // Each connection gets its own thread; they only meet at the catalog table
+    while (1) {
+        int client = accept(listen_fd, NULL, NULL);
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // Running out of descriptors or memory passes once clients finish, so wait it out
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                perror("Failed to accept connection, retrying");
+                usleep(ACCEPT_BACKOFF_USEC);
+                continue;
+            }
+            perror("Failed to accept connection");
+            break;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, handle_client, (void *) (long) client) != 0) {
+            perror("Failed to start client thread");
+            close(client);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+    close(listen_fd);
+    return -1;
+}
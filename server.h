@@ -0,0 +1,24 @@
+#ifndef _SERVER_H
+#define _SERVER_H
+
+/*
+ * Serve archive members to local clients over the Unix domain socket 'socket_path'.
+ * Any stale socket file at that path is replaced.
+ *
+ * Each client connection sends one or more newline-terminated requests:
+ *   LIST <archive>           -> "OK <count>\n" followed by one member name per line
+ *   STAT <archive> <member>  -> "OK <size> <mode> <mtime>\n" (mode in octal)
+ *   READ <archive> <member>  -> "OK <size>\n" followed by exactly <size> bytes of data
+ * Failures are answered with "ERR <message>\n".
+ * Archive paths may not contain spaces; member names may.
+ * When an archive holds several versions of a member, the most recent one is used.
+ *
+ * Parsed member catalogs are kept for every archive path requested, rebuilt when the
+ * file at that path changes inode, size or modification time, and dropped once it is gone.
+ * At most 64 catalogs are kept; beyond that the least recently used one is evicted.
+ * This function only returns if the server could not be started or stops accepting
+ * connections, in which case it returns -1.
+ */
+int serve_archives(const char *socket_path);
+
+#endif    // _SERVER_H